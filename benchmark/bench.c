@@ -0,0 +1,336 @@
+/*
+ * In-process benchmark: rufs.c is built into this program, which drives the
+ * file system operations directly against a DISKFILE, without FUSE or a
+ * mount, so changes to the core can be measured without kernel round trips.
+ * Each test reports its operations per second, the median and 99th
+ * percentile latency of a single operation, and MB/s where data is moved.
+ *
+ * usage: ./bench [-f diskfile] [-n files] [-s file_mb] [-b io_bytes] [-r random_ops]
+ *                [-c cache_blocks] [-i io_backend] [-m] [-S disk_mb] [-I inodes] [-z]
+ *
+ * The DISKFILE is made afresh for every run. It defaults to /dev/shm, which
+ * keeps the disk itself out of the numbers; point -f at a real disk to
+ * include it. -S and -I size it as rufs' mkfs_size_mb and mkfs_inodes options
+ * would, and -z turns on zero_elide.
+ */
+
+#define RUFS_NO_MAIN
+#include "../rufs.c"
+
+#include <time.h>
+
+#define BENCH_DIR "/bench"
+#define DATA_FILE "/data"
+#define SPARSE_FILE "/sparse"
+#define SPARSE_EVERY 16
+#define READDIR_ROUNDS 100
+#define MOUNT_ROUNDS 10
+
+static int nfiles = 500;
+static int file_mb = 16;
+static int io_bytes = BLOCK_SIZE;
+static int random_ops = 10000;
+
+static double *lat;
+static size_t nlat;
+static double started;
+static int nfilled;
+
+static double now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int cmp_double(const void *a, const void *b) {
+	double x = *(const double *)a, y = *(const double *)b;
+	return (x > y) - (x < y);
+}
+
+static int count_entry(void *buf, const char *name, const struct stat *st, off_t off) {
+	nfilled++;
+	return 0;
+}
+
+static void fail(const char *test, const char *what, int ret) {
+	fprintf(stderr, "%s: %s failed (%d)\n", test, what, ret);
+	exit(1);
+}
+
+static void bench_start() {
+	nlat = 0;
+	started = now();
+}
+
+// record the latency of an operation that started at t
+static inline void bench_end_op(double t) {
+	lat[nlat++] = now() - t;
+}
+
+static void bench_report(const char *name, double bytes) {
+	double secs = now() - started;
+	qsort(lat, nlat, sizeof(double), cmp_double);
+	double p50 = nlat ? lat[nlat / 2] : 0;
+	double p99 = nlat ? lat[nlat * 99 / 100] : 0;
+
+	printf("%-12s %10zu %12.0f %10.1f %10.1f", name, nlat, nlat / secs, p50 * 1e6, p99 * 1e6);
+	if (bytes > 0)
+		printf(" %10.1f", bytes / secs / (1024.0 * 1024.0));
+	printf("\n");
+}
+
+static void file_path(char *path, int i) {
+	sprintf(path, BENCH_DIR "/file-%d", i);
+}
+
+static void bench_create() {
+	char path[64];
+	bench_start();
+	for (int i = 0; i < nfiles; i++) {
+		struct fuse_file_info fi = {0};
+		file_path(path, i);
+		double t = now();
+		int ret = rufs_ope.create(path, 0644, &fi);
+		if (ret < 0)
+			fail("create", path, ret);
+		rufs_ope.release(path, &fi);
+		bench_end_op(t);
+	}
+	bench_report("create", 0);
+}
+
+// path resolution, through the dentry cache
+static void bench_lookup() {
+	char path[64];
+	struct inode inode;
+	bench_start();
+	for (int k = 0; k < random_ops; k++) {
+		file_path(path, rand() % nfiles);
+		double t = now();
+		int ret = get_node_by_path(path, 0, &inode);
+		bench_end_op(t);
+		if (ret < 0)
+			fail("lookup", path, ret);
+	}
+	bench_report("lookup", 0);
+}
+
+// one directory lookup, around the dentry cache
+static void bench_dir_find() {
+	char path[64];
+	struct inode dir;
+	struct dirent dirent;
+	if (get_node_by_path(BENCH_DIR, 0, &dir) < 0)
+		fail("dir_find", BENCH_DIR, -ENOENT);
+
+	bench_start();
+	for (int k = 0; k < random_ops; k++) {
+		file_path(path, rand() % nfiles);
+		const char *name = path + strlen(BENCH_DIR "/");
+		double t = now();
+		int ret = dir_find(dir.ino, name, strlen(name), &dirent);
+		bench_end_op(t);
+		if (ret < 0)
+			fail("dir_find", name, ret);
+	}
+	bench_report("dir_find", 0);
+}
+
+static void bench_stat() {
+	char path[64];
+	struct stat st;
+	bench_start();
+	for (int k = 0; k < random_ops; k++) {
+		file_path(path, rand() % nfiles);
+		double t = now();
+		int ret = rufs_ope.getattr(path, &st);
+		bench_end_op(t);
+		if (ret < 0)
+			fail("stat", path, ret);
+	}
+	bench_report("stat", 0);
+}
+
+static void bench_readdir() {
+	bench_start();
+	for (int k = 0; k < READDIR_ROUNDS; k++) {
+		struct fuse_file_info fi = {0};
+		nfilled = 0;
+		double t = now();
+		int ret = rufs_ope.readdir(BENCH_DIR, NULL, count_entry, 0, &fi);
+		bench_end_op(t);
+		if (ret < 0 || nfilled != nfiles + 2)
+			fail("readdir", BENCH_DIR, ret);
+	}
+	bench_report("readdir", 0);
+}
+
+// sequential passes over the whole data file, written in io_bytes pieces
+static void bench_seq(int write) {
+	const char *name = write ? "seq_write" : "seq_read";
+	size_t size = (size_t)file_mb << 20;
+	char *buf = malloc(io_bytes);
+	memset(buf, 0x5a, io_bytes);
+
+	struct fuse_file_info fi = {0};
+	bench_start();
+	int ret = write ? rufs_ope.create(DATA_FILE, 0644, &fi) : rufs_ope.open(DATA_FILE, &fi);
+	if (ret < 0)
+		fail(name, DATA_FILE, ret);
+	for (size_t off = 0; off + io_bytes <= size; off += io_bytes) {
+		double t = now();
+		ret = write ? rufs_ope.write(DATA_FILE, buf, io_bytes, off, &fi) : rufs_ope.read(DATA_FILE, buf, io_bytes, off, &fi);
+		bench_end_op(t);
+		if (ret != io_bytes)
+			fail(name, DATA_FILE, ret);
+	}
+	// the write buffer is flushed on release, and counted
+	rufs_ope.release(DATA_FILE, &fi);
+	bench_report(name, (double)nlat * io_bytes);
+	free(buf);
+}
+
+// random io_bytes-aligned pieces of the data file
+static void bench_random(int write) {
+	const char *name = write ? "rand_write" : "rand_read";
+	size_t pieces = ((size_t)file_mb << 20) / io_bytes;
+	char *buf = malloc(io_bytes);
+	memset(buf, 0xa5, io_bytes);
+
+	struct fuse_file_info fi = {0};
+	bench_start();
+	int ret = rufs_ope.open(DATA_FILE, &fi);
+	if (ret < 0)
+		fail(name, DATA_FILE, ret);
+	for (int k = 0; k < random_ops; k++) {
+		off_t off = (off_t)(rand() % pieces) * io_bytes;
+		double t = now();
+		ret = write ? rufs_ope.write(DATA_FILE, buf, io_bytes, off, &fi) : rufs_ope.read(DATA_FILE, buf, io_bytes, off, &fi);
+		bench_end_op(t);
+		if (ret != io_bytes)
+			fail(name, DATA_FILE, ret);
+	}
+	rufs_ope.release(DATA_FILE, &fi);
+	bench_report(name, (double)nlat * io_bytes);
+	free(buf);
+}
+
+// a VM image: file_mb of blocks that are zeros but for one in SPARSE_EVERY,
+// written in order; the blocks it takes up are reported alongside
+static void bench_sparse_write() {
+	char *buf = calloc(1, BLOCK_SIZE);
+	uint32_t free_before = d_free;
+
+	struct fuse_file_info fi = {0};
+	bench_start();
+	int ret = rufs_ope.create(SPARSE_FILE, 0644, &fi);
+	if (ret < 0)
+		fail("sparse_write", SPARSE_FILE, ret);
+	for (size_t k = 0; k < ((size_t)file_mb << 20) / BLOCK_SIZE; k++) {
+		buf[0] = (k % SPARSE_EVERY == 0);
+		double t = now();
+		ret = rufs_ope.write(SPARSE_FILE, buf, BLOCK_SIZE, (off_t)k * BLOCK_SIZE, &fi);
+		bench_end_op(t);
+		if (ret != BLOCK_SIZE)
+			fail("sparse_write", SPARSE_FILE, ret);
+	}
+	rufs_ope.release(SPARSE_FILE, &fi);
+	bench_report("sparse_write", (double)nlat * BLOCK_SIZE);
+	printf("%-12s %10u blocks allocated\n", "", free_before - d_free);
+	free(buf);
+}
+
+// walk the data of the sparse file with SEEK_DATA and SEEK_HOLE
+static void bench_seek_data() {
+	off_t size = (off_t)file_mb << 20;
+	bench_start();
+	for (off_t off = 0; off < size; ) {
+		double t = now();
+		off_t data = rufs_lseek(SPARSE_FILE, off, SEEK_DATA, NULL);
+		off = (data < 0) ? size : rufs_lseek(SPARSE_FILE, data, SEEK_HOLE, NULL);
+		bench_end_op(t);
+		if (off < 0)
+			fail("seek_data", SPARSE_FILE, off);
+	}
+	bench_report("seek_data", 0);
+}
+
+// unmount and mount the file system again, which reads back only its summary
+static void bench_mount() {
+	bench_start();
+	for (int k = 0; k < MOUNT_ROUNDS; k++) {
+		rufs_ope.destroy(NULL);
+		double t = now();
+		rufs_ope.init(NULL);
+		bench_end_op(t);
+	}
+	bench_report("mount", 0);
+}
+
+static void usage(const char *prog) {
+	fprintf(stderr, "usage: %s [-f diskfile] [-n files] [-s file_mb] [-b io_bytes] [-r random_ops]\n"
+		"       [-c cache_blocks] [-i io_backend] [-m] [-S disk_mb] [-I inodes] [-z]\n", prog);
+	exit(1);
+}
+
+int main(int argc, char **argv) {
+	int c;
+	strcpy(diskfile_path, "/dev/shm/rufs_bench_DISKFILE");
+	while ((c = getopt(argc, argv, "f:n:s:b:r:c:i:mS:I:z")) != -1) {
+		switch (c) {
+		case 'f': snprintf(diskfile_path, PATH_MAX, "%s", optarg); break;
+		case 'n': nfiles = atoi(optarg); break;
+		case 's': file_mb = atoi(optarg); break;
+		case 'b': io_bytes = atoi(optarg); break;
+		case 'r': random_ops = atoi(optarg); break;
+		case 'c': opts.cache_blocks = atoi(optarg); break;
+		case 'i': opts.io_backend = optarg; break;
+		case 'm': opts.use_mmap = 1; break;
+		case 'S': opts.mkfs_size_mb = atoi(optarg); break;
+		case 'I': opts.mkfs_inodes = atoi(optarg); break;
+		case 'z': opts.zero_elide = 1; break;
+		default: usage(argv[0]);
+		}
+	}
+	if (nfiles < 1 || file_mb < 1 || io_bytes < 1 || random_ops < 1 || ((size_t)file_mb << 20) < (size_t)io_bytes)
+		usage(argv[0]);
+	struct superblock geo;
+	if (mkfs_layout(&geo) < 0)
+		usage(argv[0]);
+
+	size_t most = READDIR_ROUNDS;
+	if (most < (size_t)nfiles)
+		most = nfiles;
+	if (most < (size_t)random_ops)
+		most = random_ops;
+	if (most < ((size_t)file_mb << 20) / io_bytes)
+		most = ((size_t)file_mb << 20) / io_bytes;
+	lat = malloc(most * sizeof(double));
+
+	// start from an empty file system
+	unlink(diskfile_path);
+	rufs_ope.init(NULL);
+	if (rufs_ope.mkdir(BENCH_DIR, 0755) < 0)
+		fail("mkdir", BENCH_DIR, -1);
+
+	srand(1);
+	printf("%d files, %d MB data file, %d byte I/O, %d random ops\n", nfiles, file_mb, io_bytes, random_ops);
+	printf("%-12s %10s %12s %10s %10s %10s\n", "test", "ops", "ops/s", "p50 us", "p99 us", "MB/s");
+	bench_create();
+	bench_lookup();
+	bench_dir_find();
+	bench_stat();
+	bench_readdir();
+	bench_seq(1);
+	bench_seq(0);
+	bench_random(1);
+	bench_random(0);
+	bench_sparse_write();
+	bench_seek_data();
+	bench_mount();
+
+	rufs_ope.destroy(NULL);
+	unlink(diskfile_path);
+	free(lat);
+	return 0;
+}
@@ -0,0 +1,174 @@
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/types.h>
+#include <pthread.h>
+#include <time.h>
+
+/* You need to change this macro to your RUFS mount point*/
+#define TESTDIR "/tmp/mountdir"
+
+/*
+ * Multithreaded scaling benchmark: every thread works on files of its own, in
+ * a directory of its own (create, write, read back, stat, unlink), so the only
+ * shared state is the file system itself. Each round keeps its threads busy
+ * for at least seconds, in passes over files_per_thread files of
+ * blocks_per_file blocks each. Run it against a mount WITHOUT -s and compare
+ * the throughput for increasing thread counts.
+ *
+ * usage: ./scaling [max_threads] [seconds] [files_per_thread] [blocks_per_file]
+ */
+
+#define BLOCKSIZE 4096
+#define FSPATHLEN 256
+#define STATS_PER_FILE 64
+#define FILEPERM 0666
+#define DIRPERM 0755
+
+static double seconds = 2;
+static int files_per_thread = 32;
+static int blocks_per_file = 32;
+
+struct worker {
+	pthread_t tid;
+	int id;
+	int round;
+	int failed;
+	double deadline;
+	long files;			/* files done */
+};
+
+static double now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *run_worker(void *arg) {
+	struct worker *w = arg;
+	char dir[FSPATHLEN];
+	char path[FSPATHLEN];
+	char buf[BLOCKSIZE];
+	struct stat st;
+	int fd, i, j, pass;
+
+	snprintf(dir, FSPATHLEN, TESTDIR "/scaling/r%d-t%d", w->round, w->id);
+	if (mkdir(dir, DIRPERM) < 0) {
+		perror("mkdir");
+		w->failed = 1;
+		return NULL;
+	}
+
+	for (pass = 0; now() < w->deadline; pass++)
+	for (i = 0; i < files_per_thread; i++) {
+		snprintf(path, FSPATHLEN, TESTDIR "/scaling/r%d-t%d/p%d-f%d", w->round, w->id, pass, i);
+
+		if ((fd = creat(path, FILEPERM)) < 0) {
+			perror("creat");
+			w->failed = 1;
+			return NULL;
+		}
+		for (j = 0; j < blocks_per_file; j++) {
+			memset(buf, 0x61 + (w->id + j) % 26, BLOCKSIZE);
+			if (write(fd, buf, BLOCKSIZE) != BLOCKSIZE) {
+				w->failed = 1;
+				close(fd);
+				return NULL;
+			}
+		}
+		close(fd);
+
+		if ((fd = open(path, O_RDONLY)) < 0) {
+			perror("open");
+			w->failed = 1;
+			return NULL;
+		}
+		for (j = 0; j < blocks_per_file; j++) {
+			if (read(fd, buf, BLOCKSIZE) != BLOCKSIZE || buf[0] != 0x61 + (w->id + j) % 26) {
+				w->failed = 1;
+				close(fd);
+				return NULL;
+			}
+		}
+		close(fd);
+
+		for (j = 0; j < STATS_PER_FILE; j++) {
+			if (stat(path, &st) < 0) {
+				w->failed = 1;
+				return NULL;
+			}
+		}
+
+		// the space goes back, so rounds of any length fit on the disk
+		if (unlink(path) < 0) {
+			perror("unlink");
+			w->failed = 1;
+			return NULL;
+		}
+		w->files++;
+	}
+
+	rmdir(dir);
+	return NULL;
+}
+
+int main(int argc, char **argv) {
+	int max_threads = argc > 1 ? atoi(argv[1]) : 8;
+	int nthreads, round = 0, i;
+	if (argc > 2)
+		seconds = atof(argv[2]);
+	if (argc > 3)
+		files_per_thread = atoi(argv[3]);
+	if (argc > 4)
+		blocks_per_file = atoi(argv[4]);
+	if (max_threads < 1 || seconds <= 0 || files_per_thread < 1 || blocks_per_file < 1) {
+		fprintf(stderr, "usage: %s [max_threads] [seconds] [files_per_thread] [blocks_per_file]\n", argv[0]);
+		exit(1);
+	}
+
+	if (mkdir(TESTDIR "/scaling", DIRPERM) < 0 && errno != EEXIST) {
+		perror("mkdir");
+		exit(1);
+	}
+
+	printf("%8s %10s %12s %12s %10s\n", "threads", "seconds", "files/s", "MB/s", "speedup");
+
+	double base = 0;
+	for (nthreads = 1; nthreads <= max_threads; nthreads *= 2, round++) {
+		struct worker *w = calloc(nthreads, sizeof(struct worker));
+
+		double start = now();
+		double files = 0;
+		for (i = 0; i < nthreads; i++) {
+			w[i].id = i;
+			w[i].round = round;
+			w[i].deadline = start + seconds;
+			pthread_create(&w[i].tid, NULL, run_worker, &w[i]);
+		}
+		for (i = 0; i < nthreads; i++) {
+			pthread_join(w[i].tid, NULL);
+			if (w[i].failed) {
+				printf("thread %d failed, is the file system mounted at %s?\n", i, TESTDIR);
+				exit(1);
+			}
+			files += w[i].files;
+		}
+		double secs = now() - start;
+
+		// each file is written once and read back once
+		double mb = files * blocks_per_file * BLOCKSIZE * 2 / (1024.0 * 1024.0);
+		double rate = files / secs;
+		if (nthreads == 1)
+			base = rate;
+
+		printf("%8d %10.3f %12.1f %12.1f %9.2fx\n", nthreads, secs, rate, mb / secs, rate / base);
+		free(w);
+	}
+
+	printf("Benchmark completed \n");
+	return 0;
+}
@@ -7,6 +7,7 @@
  *
  */
 
+#define _GNU_SOURCE		/* fallocate */
 #include <fcntl.h>
 #include <stdlib.h>
 #include <string.h>
@@ -14,27 +15,344 @@
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <errno.h>
+#include <pthread.h>
+#include <linux/io_uring.h>
+#undef BLOCK_SIZE		/* linux/fs.h's, block.h has ours */
 
 #include "block.h"
+#include "stats.h"
 
-//Disk size set to 32MB
-#define DISK_SIZE	32*1024*1024
+//Most iovecs handed to a single request
+#define BIO_MAX_IOV	64
+
+//Submission queue size of each thread's io_uring
+#define URING_ENTRIES	64
 
 int diskfile = -1;
 
-//Creates a file which is your new emulated disk
-void dev_init(const char* diskfile_path) {
-    if (diskfile >= 0) {
+static char *diskmap;				/* the mapped DISKFILE, see dev_map() */
+static size_t diskmap_len;
+
+static int jactive;					/* a journal is attached, see journal_open() */
+static int journal_lookup(int block_num, void *buf);
+static int journal_write(int block_num, const void *buf);
+static void journal_revoke(int block_num, size_t n);
+
+/*
+ * I/O backends
+ *
+ * every disk access is a batch of requests, each one a vectored read or
+ * write of contiguous blocks, handed to the active backend. The pread
+ * backend runs them one after another. The io_uring backend submits the
+ * whole batch at once and reaps the completions together, keeping up to
+ * URING_ENTRIES of them in flight; every thread gets its own ring, and a
+ * thread that cannot set one up falls back to pread.
+ */
+struct bio_req {
+	int				write;			/* pwritev rather than preadv */
+	int				block_num;		/* first block */
+	struct iovec*	iov;
+	int				iovcnt;
+	ssize_t			result;			/* bytes moved, or -errno */
+};
+
+struct bio_backend {
+	const char*	name;
+	int			(*probe)(void);		/* 0 if the backend works here */
+	void		(*submit)(struct bio_req *reqs, size_t n);
+};
+
+static void pread_submit(struct bio_req *reqs, size_t n) {
+	for (size_t i = 0; i < n; i++) {
+		struct bio_req *r = &reqs[i];
+		off_t pos = (off_t)r->block_num * BLOCK_SIZE;
+		r->result = r->write ? pwritev(diskfile, r->iov, r->iovcnt, pos) : preadv(diskfile, r->iov, r->iovcnt, pos);
+		if (r->result < 0)
+			r->result = -errno;
+	}
+}
+
+static int pread_probe(void) {
+	return 0;
+}
+
+struct uring {
+	int						fd;
+	unsigned				sq_entries;
+	unsigned*				sq_head;
+	unsigned*				sq_tail;
+	unsigned*				sq_mask;
+	unsigned*				sq_array;
+	unsigned*				cq_head;
+	unsigned*				cq_tail;
+	unsigned*				cq_mask;
+	struct io_uring_sqe*	sqes;
+	struct io_uring_cqe*	cqes;
+	void*					sq_ring;
+	void*					cq_ring;
+	size_t					sq_ring_len;
+	size_t					cq_ring_len;
+};
+
+static pthread_key_t uring_key;
+static pthread_once_t uring_once = PTHREAD_ONCE_INIT;
+
+static void uring_free(void *arg) {
+	struct uring *u = arg;
+	if (!u)
 		return;
+	munmap(u->sqes, u->sq_entries * sizeof(struct io_uring_sqe));
+	if (u->cq_ring != u->sq_ring)
+		munmap(u->cq_ring, u->cq_ring_len);
+	munmap(u->sq_ring, u->sq_ring_len);
+	close(u->fd);
+	free(u);
+}
+
+static void uring_key_init(void) {
+	pthread_key_create(&uring_key, uring_free);
+}
+
+static struct uring *uring_setup(void) {
+	struct io_uring_params p;
+	memset(&p, 0, sizeof(p));
+	int fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+	if (fd < 0)
+		return NULL;
+
+	struct uring *u = calloc(1, sizeof(struct uring));
+	if (!u) {
+		close(fd);
+		return NULL;
+	}
+	u->fd = fd;
+	u->sq_entries = p.sq_entries;
+	u->sq_ring_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	u->cq_ring_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (u->cq_ring_len > u->sq_ring_len)
+			u->sq_ring_len = u->cq_ring_len;
+		u->cq_ring_len = u->sq_ring_len;
+	}
+
+	u->sq_ring = mmap(NULL, u->sq_ring_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	if (u->sq_ring == MAP_FAILED) {
+		close(fd);
+		free(u);
+		return NULL;
+	}
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		u->cq_ring = u->sq_ring;
+	} else {
+		u->cq_ring = mmap(NULL, u->cq_ring_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+	}
+	u->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+	if (u->cq_ring == MAP_FAILED || u->sqes == MAP_FAILED) {
+		if (u->sqes != MAP_FAILED)
+			munmap(u->sqes, p.sq_entries * sizeof(struct io_uring_sqe));
+		if (u->cq_ring != MAP_FAILED && u->cq_ring != u->sq_ring)
+			munmap(u->cq_ring, u->cq_ring_len);
+		munmap(u->sq_ring, u->sq_ring_len);
+		close(fd);
+		free(u);
+		return NULL;
+	}
+
+	char *sq = u->sq_ring, *cq = u->cq_ring;
+	u->sq_head = (unsigned*)(sq + p.sq_off.head);
+	u->sq_tail = (unsigned*)(sq + p.sq_off.tail);
+	u->sq_mask = (unsigned*)(sq + p.sq_off.ring_mask);
+	u->sq_array = (unsigned*)(sq + p.sq_off.array);
+	u->cq_head = (unsigned*)(cq + p.cq_off.head);
+	u->cq_tail = (unsigned*)(cq + p.cq_off.tail);
+	u->cq_mask = (unsigned*)(cq + p.cq_off.ring_mask);
+	u->cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+	return u;
+}
+
+//The calling thread's ring, set up on first use; NULL if io_uring is not available to it
+static struct uring *uring_get(void) {
+	pthread_once(&uring_once, uring_key_init);
+	struct uring *u = pthread_getspecific(uring_key);
+	if (!u) {
+		u = uring_setup();
+		if (u)
+			pthread_setspecific(uring_key, u);
+	}
+	return u;
+}
+
+//Reap every completion that is there; returns how many
+static unsigned uring_reap(struct uring *u, struct bio_req *reqs) {
+	unsigned head = *u->cq_head, n = 0;
+	unsigned ctail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+	for (; head != ctail; head++, n++) {
+		struct io_uring_cqe *cqe = &u->cqes[head & *u->cq_mask];
+		reqs[cqe->user_data].result = cqe->res;
+	}
+	__atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+	return n;
+}
+
+static void uring_submit(struct bio_req *reqs, size_t n) {
+	struct uring *u = uring_get();
+	if (!u) {
+		pread_submit(reqs, n);
+		return;
+	}
+
+	// queued: in the ring, not taken by the kernel yet; inflight: taken, not reaped
+	size_t next = 0, done = 0;
+	unsigned queued = 0, inflight = 0;
+	int failed = 0;
+	while (done < n) {
+		// queue as much of the batch as the ring takes
+		unsigned tail = *u->sq_tail;
+		while (next < n && inflight + queued < u->sq_entries) {
+			unsigned idx = tail & *u->sq_mask;
+			struct io_uring_sqe *sqe = &u->sqes[idx];
+			memset(sqe, 0, sizeof(*sqe));
+			sqe->opcode = reqs[next].write ? IORING_OP_WRITEV : IORING_OP_READV;
+			sqe->fd = diskfile;
+			sqe->addr = (uintptr_t)reqs[next].iov;
+			sqe->len = reqs[next].iovcnt;
+			sqe->off = (uint64_t)reqs[next].block_num * BLOCK_SIZE;
+			sqe->user_data = next;
+			u->sq_array[idx] = idx;
+			reqs[next].result = -EINPROGRESS;
+			tail++;
+			next++;
+			queued++;
+		}
+		__atomic_store_n(u->sq_tail, tail, __ATOMIC_RELEASE);
+
+		// submit them and wait for at least one completion. The kernel may take
+		// fewer than queued; the rest stay in the ring for the next round. It
+		// is only busy while completions are owed, which reaping then frees up
+		int ret = syscall(__NR_io_uring_enter, u->fd, queued, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+		if (ret >= 0) {
+			queued -= ret;
+			inflight += ret;
+		} else if (errno != EINTR && !((errno == EAGAIN || errno == EBUSY) && inflight > 0)) {
+			failed = 1;
+			break;
+		}
+
+		unsigned reaped = uring_reap(u, reqs);
+		inflight -= reaped;
+		done += reaped;
+	}
+	if (!failed)
+		return;
+
+	// the ring is unusable: take back what the kernel was not given, wait for
+	// what it was, and drop the ring, which cancels whatever it still holds.
+	// The thread sets up a new one next time; this batch finishes with pread
+	perror("io_uring_enter failed");
+	__atomic_store_n(u->sq_tail, *u->sq_tail - queued, __ATOMIC_RELEASE);
+	while (inflight > 0) {
+		int ret = syscall(__NR_io_uring_enter, u->fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+		if (ret < 0 && errno != EINTR)
+			break;
+		inflight -= uring_reap(u, reqs);
+	}
+	pthread_setspecific(uring_key, NULL);
+	uring_free(u);
+
+	for (size_t i = 0; i < next; i++) {
+		if (reqs[i].result == -EINPROGRESS)
+			pread_submit(&reqs[i], 1);
+	}
+	pread_submit(reqs + next, n - next);
+}
+
+static int uring_probe(void) {
+	return uring_get() ? 0 : -1;
+}
+
+static const struct bio_backend backends[] = {
+	{ "pread",	pread_probe,	pread_submit },
+	{ "uring",	uring_probe,	uring_submit },
+};
+
+static const struct bio_backend *backend = &backends[0];
+
+//Select the I/O backend by name; NULL picks io_uring where it works and pread elsewhere
+int bio_set_backend(const char *name) {
+	if (!name) {
+		backend = (uring_probe() == 0) ? &backends[1] : &backends[0];
+		return 0;
+	}
+	for (size_t i = 0; i < sizeof(backends) / sizeof(backends[0]); i++) {
+		if (strcmp(name, backends[i].name) == 0) {
+			if (backends[i].probe() < 0)
+				return -1;
+			backend = &backends[i];
+			return 0;
+		}
+	}
+	return -1;
+}
+
+const char *bio_backend_name() {
+	return backend->name;
+}
+
+/*
+ * Block buffer cache
+ *
+ * bio_read/bio_write are served from a fixed pool of block buffers, indexed
+ * by block number through a chained hash table and recycled in LRU order.
+ * Writes only dirty the cached copy: a dirty buffer reaches the disk when it
+ * is evicted or when bio_flush() is called.
+ *
+ * bcache_lock protects the table, the lists and every buffer header. Disk I/O
+ * is done without it: the buffer is marked busy instead, and anyone else who
+ * needs that buffer waits on bcache_cond until the I/O has finished.
+ *
+ * bio_readv/bio_writev move runs of contiguous blocks for file data. They use
+ * the cached copy of any block that has one, but move the others straight
+ * between the disk and the caller's buffers, one preadv/pwritev per stretch
+ * of uncached blocks, without bringing them into the cache. The caller must
+ * keep other threads off those blocks meanwhile (rufs does, via ilock()).
+ * bio_discard() punches blocks the file system has freed out of the
+ * DISKFILE, dropping their cached copies unwritten.
+ */
+struct buf {
+	int			blkno;			/* cached block number, -1 if unused */
+	int			dirty;			/* cached copy is newer than the disk */
+	int			busy;			/* disk I/O in progress, data must not be touched */
+	int			failed;			/* its writeback failed; kept dirty and not recycled */
+	struct buf*	hash_next;		/* next buffer in the same hash chain */
+	struct buf*	lru_prev;		/* towards the most recently used end */
+	struct buf*	lru_next;		/* towards the least recently used end */
+	char		data[BLOCK_SIZE];
+};
+
+static struct buf* bufs;			/* buffer pool */
+static struct buf** hash_tbl;		/* hash chains, indexed by blkno & hash_mask */
+static size_t hash_mask;
+static struct buf lru;				/* list head: lru.lru_next is the most recent */
+static size_t bcache_cap;			/* number of buffers, 0 if the cache is off */
+static struct bcache_stats bstats;
+static pthread_mutex_t bcache_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t bcache_cond = PTHREAD_COND_INITIALIZER;
+
+//Creates a file which is your new emulated disk, nblocks blocks long
+void dev_init(const char* diskfile_path, size_t nblocks) {
+    if (diskfile < 0) {
+		diskfile = open(diskfile_path, O_CREAT | O_RDWR, S_IRUSR | S_IWUSR);
     }
-    
-    diskfile = open(diskfile_path, O_CREAT | O_RDWR, S_IRUSR | S_IWUSR);
     if (diskfile < 0) {
 		perror("disk_open failed");
 		exit(EXIT_FAILURE);
     }
 	
-    ftruncate(diskfile, DISK_SIZE);
+    ftruncate(diskfile, (off_t)nblocks * BLOCK_SIZE);
 }
 
 //Function to open the disk file
@@ -53,30 +371,1073 @@ int dev_open(const char* diskfile_path) {
 
 void dev_close() {
     if (diskfile >= 0) {
+		journal_close();
+		bio_flush();
+		if (diskmap) {
+			munmap(diskmap, diskmap_len);
+			diskmap = NULL;
+			diskmap_len = 0;
+		}
 		close(diskfile);
+		diskfile = -1;
     }
+	bcache_destroy();
+}
+
+/*
+ * Memory-mapped mode
+ *
+ * once dev_map() has mapped the DISKFILE, blocks inside the mapping bypass
+ * the block cache and the I/O backend: bio_* copy straight to and from the
+ * mapping, and bio_view() hands out pointers into it. The kernel's page
+ * cache does the caching; bio_flush() starts writeback and bio_sync() waits
+ * for it. Like the block cache, the mapping expects callers to keep other
+ * threads off the blocks they are writing.
+ */
+
+//Map the first nblocks blocks of the open DISKFILE, growing it to that size if needed
+int dev_map(size_t nblocks) {
+	if (diskfile < 0) {
+		return -1;
+	}
+	if (diskmap) {
+		return 0;
+	}
+
+	size_t len = nblocks * BLOCK_SIZE;
+	struct stat st;
+	if (fstat(diskfile, &st) < 0 || ((size_t)st.st_size < len && ftruncate(diskfile, len) < 0)) {
+		perror("disk_map failed");
+		return -1;
+	}
+
+	// whatever the cache holds has to be in the file before the cache is bypassed
+	if (bio_flush() < 0) {
+		return -1;
+	}
+
+	void *map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, diskfile, 0);
+	if (map == MAP_FAILED) {
+		perror("disk_map failed");
+		return -1;
+	}
+	diskmap = map;
+	diskmap_len = len;
+	bcache_destroy();
+	return 0;
+}
+
+//Address of block_num in the mapping, NULL if it is not mapped
+static inline char *map_block(int block_num) {
+	if (!diskmap || block_num < 0 || (size_t)(block_num + 1) * BLOCK_SIZE > diskmap_len) {
+		return NULL;
+	}
+	return diskmap + (size_t)block_num * BLOCK_SIZE;
+}
+
+//Contents of block_num for reading only: a pointer into the mapping if the block
+//is mapped, else buf after reading the block into it
+const void *bio_view(const int block_num, void *buf) {
+	// a journaled block's newest image is not in the mapping yet
+	if (jactive && journal_lookup(block_num, buf)) {
+		return buf;
+	}
+	const char *m = map_block(block_num);
+	if (m) {
+		return m;
+	}
+	bio_read(block_num, buf);
+	return buf;
+}
+
+//Writable address of block_num in the mapping, NULL if it is not mapped or if
+//writes have to go through the journal
+void *bio_map(const int block_num) {
+	if (jactive) {
+		return NULL;
+	}
+	return map_block(block_num);
+}
+
+//Wait for what has been written to the DISKFILE, through the mapping or not, to reach
+//stable storage
+static int dev_sync() {
+	if (diskmap) {
+		return msync(diskmap, diskmap_len, MS_SYNC);
+	}
+	return fdatasync(diskfile);
+}
+
+//Flush and wait until everything written so far is on stable storage
+int bio_sync() {
+	int ret = bio_flush();
+	if (diskmap) {
+		if (msync(diskmap, diskmap_len, MS_SYNC) < 0)
+			ret = -1;
+	} else if (diskfile >= 0 && fsync(diskfile) < 0) {
+		ret = -1;
+	}
+	return ret;
+}
+
+//Run a batch of requests through the backend. Whatever a read could not get
+//(past the end of the disk) reads as zeros; returns -1 if any request failed
+static int dev_submit(struct bio_req *reqs, size_t n) {
+	backend->submit(reqs, n);
+
+	int ret = 0;
+	for (size_t i = 0; i < n; i++) {
+		struct bio_req *r = &reqs[i];
+		size_t want = 0;
+		for (int j = 0; j < r->iovcnt; j++)
+			want += r->iov[j].iov_len;
+		if (r->result == (ssize_t)want)
+			continue;
+
+		if (r->result < 0) {
+			errno = -r->result;
+			perror(r->write ? "block_write failed" : "block_read failed");
+			ret = -1;
+		} else if (r->write) {
+			ret = -1;
+		}
+		if (r->write)
+			continue;
+
+		size_t skip = r->result > 0 ? r->result : 0;
+		for (int j = 0; j < r->iovcnt; j++) {
+			if (skip >= r->iov[j].iov_len) {
+				skip -= r->iov[j].iov_len;
+				continue;
+			}
+			memset((char*)r->iov[j].iov_base + skip, 0, r->iov[j].iov_len - skip);
+			skip = 0;
+		}
+	}
+	return ret;
+}
+
+//Read a block straight from the disk, bypassing the cache
+static int dev_read(const int block_num, void *buf) {
+	struct iovec iov = { buf, BLOCK_SIZE };
+	struct bio_req req = { 0, block_num, &iov, 1, 0 };
+	return dev_submit(&req, 1) < 0 ? -1 : BLOCK_SIZE;
+}
+
+//Write a block straight to the disk, bypassing the cache
+static int dev_write(const int block_num, const void *buf) {
+	struct iovec iov = { (void*)buf, BLOCK_SIZE };
+	struct bio_req req = { 1, block_num, &iov, 1, 0 };
+	return dev_submit(&req, 1) < 0 ? -1 : BLOCK_SIZE;
+}
+
+//Address of block k of a run laid out over iov; every iov_len is a multiple of BLOCK_SIZE
+static char *iov_block(const struct iovec *iov, int iovcnt, size_t k) {
+	for (int i = 0; i < iovcnt; i++) {
+		size_t n = iov[i].iov_len / BLOCK_SIZE;
+		if (k < n)
+			return (char*)iov[i].iov_base + k * BLOCK_SIZE;
+		k -= n;
+	}
+	return NULL;
+}
+
+//Read (or write) the blocks of the run at block_num that are flagged in want straight
+//from (to) the disk, as one batch with a request per stretch of adjacent blocks.
+//Blocks next to each other in memory share an iovec
+static int dev_rwv(int write, int block_num, const struct iovec *iov, int iovcnt, const char *want, size_t n) {
+	struct iovec *v = malloc(n * sizeof(struct iovec));
+	struct bio_req *reqs = malloc(n * sizeof(struct bio_req));
+	if (!v || !reqs) {
+		free(v);
+		free(reqs);
+		return -1;
+	}
+
+	size_t nreq = 0, nv = 0;
+	for (size_t k = 0; k < n; k++) {
+		if (!want[k])
+			continue;
+		char *p = iov_block(iov, iovcnt, k);
+
+		// a block continues the last request if it follows it on the disk
+		struct bio_req *r = nreq ? &reqs[nreq - 1] : NULL;
+		if (r && k > 0 && want[k - 1] && r->iovcnt <= BIO_MAX_IOV) {
+			struct iovec *last = &r->iov[r->iovcnt - 1];
+			if ((char*)last->iov_base + last->iov_len == p) {
+				last->iov_len += BLOCK_SIZE;
+				continue;
+			}
+			if (r->iovcnt < BIO_MAX_IOV) {
+				v[nv] = (struct iovec){ p, BLOCK_SIZE };
+				nv++;
+				r->iovcnt++;
+				continue;
+			}
+		}
+
+		v[nv] = (struct iovec){ p, BLOCK_SIZE };
+		reqs[nreq++] = (struct bio_req){ write, block_num + k, &v[nv], 1, 0 };
+		nv++;
+	}
+
+	int ret = dev_submit(reqs, nreq);
+	free(v);
+	free(reqs);
+	return ret;
+}
+
+static void lru_unlink(struct buf *b) {
+	b->lru_prev->lru_next = b->lru_next;
+	b->lru_next->lru_prev = b->lru_prev;
+}
+
+static void lru_push_front(struct buf *b) {
+	b->lru_prev = &lru;
+	b->lru_next = lru.lru_next;
+	lru.lru_next->lru_prev = b;
+	lru.lru_next = b;
+}
+
+static void hash_remove(struct buf *b) {
+	struct buf **pp = &hash_tbl[b->blkno & hash_mask];
+	while (*pp != b)
+		pp = &(*pp)->hash_next;
+	*pp = b->hash_next;
+}
+
+static struct buf *hash_lookup(int block_num) {
+	struct buf *b = hash_tbl[block_num & hash_mask];
+	while (b && b->blkno != block_num)
+		b = b->hash_next;
+	return b;
+}
+
+//Wait for the I/O on a busy buffer to finish; called and returns with bcache_lock held
+static void buf_wait(struct buf *b) {
+	while (b->busy)
+		pthread_cond_wait(&bcache_cond, &bcache_lock);
+}
+
+//Forget the block a buffer holds, dirty or not, and queue the buffer for recycling first
+static void buf_discard(struct buf *b) {
+	hash_remove(b);
+	b->blkno = -1;
+	b->dirty = 0;
+	b->failed = 0;
+	lru_unlink(b);
+	b->lru_next = &lru;
+	b->lru_prev = lru.lru_prev;
+	lru.lru_prev->lru_next = b;
+	lru.lru_prev = b;
+	bstats.cached--;
+}
+
+//Find the buffer for block_num or recycle the least recently used idle one for it.
+//Returns with bcache_lock held and the buffer not busy; *miss tells whether it is new.
+//NULL if block_num is not cached and every buffer holds a write the disk refused
+static struct buf *bcache_get(int block_num, int *miss) {
+	for (;;) {
+		struct buf *b = hash_lookup(block_num);
+		if (b) {
+			if (b->busy) {
+				buf_wait(b);
+				continue;
+			}
+			bstats.hits++;
+			*miss = 0;
+			return b;
+		}
+
+		// oldest buffer that nobody is doing I/O on and that can be written back
+		int busy = 0;
+		b = lru.lru_prev;
+		while (b != &lru && (b->busy || b->failed)) {
+			busy |= (b->busy != 0);
+			b = b->lru_prev;
+		}
+		if (b == &lru) {
+			if (!busy)
+				return NULL;
+			pthread_cond_wait(&bcache_cond, &bcache_lock);
+			continue;
+		}
+
+		// a dirty victim is written back first, after which everything is looked at again.
+		// One the disk refuses stays dirty, and cached, for bio_flush to retry
+		if (b->blkno >= 0 && b->dirty) {
+			b->busy = 1;
+			pthread_mutex_unlock(&bcache_lock);
+			int ret = dev_write(b->blkno, b->data);
+			pthread_mutex_lock(&bcache_lock);
+			b->busy = 0;
+			if (ret < 0) {
+				fprintf(stderr, "bcache: writeback of block %d failed, kept dirty\n", b->blkno);
+				b->failed = 1;
+			} else {
+				b->dirty = 0;
+				bstats.writebacks++;
+			}
+			pthread_cond_broadcast(&bcache_cond);
+			continue;
+		}
+
+		if (b->blkno >= 0) {
+			hash_remove(b);
+			bstats.evictions++;
+		} else {
+			bstats.cached++;
+		}
+
+		b->blkno = block_num;
+		b->dirty = 0;
+		b->hash_next = hash_tbl[block_num & hash_mask];
+		hash_tbl[block_num & hash_mask] = b;
+		bstats.misses++;
+		*miss = 1;
+		return b;
+	}
+}
+
+//Allocate a cache of nblocks buffers; 0 leaves the cache disabled
+int bcache_init(size_t nblocks) {
+	if (bcache_cap > 0 || nblocks == 0) {
+		return 0;
+	}
+
+	size_t nhash = 1;
+	while (nhash < nblocks)
+		nhash <<= 1;
+
+	bufs = calloc(nblocks, sizeof(struct buf));
+	hash_tbl = calloc(nhash, sizeof(struct buf*));
+	if (!bufs || !hash_tbl) {
+		free(bufs);
+		free(hash_tbl);
+		bufs = NULL;
+		hash_tbl = NULL;
+		return -1;
+	}
+
+	hash_mask = nhash - 1;
+	lru.lru_prev = lru.lru_next = &lru;
+	for (size_t i = 0; i < nblocks; i++) {
+		bufs[i].blkno = -1;
+		lru_push_front(&bufs[i]);
+	}
+
+	memset(&bstats, 0, sizeof(bstats));
+	bstats.capacity = nblocks;
+	bcache_cap = nblocks;
+	return 0;
+}
+
+//Release the cache; dirty buffers must have been flushed beforehand
+void bcache_destroy() {
+	free(bufs);
+	free(hash_tbl);
+	bufs = NULL;
+	hash_tbl = NULL;
+	bcache_cap = 0;
+	memset(&bstats, 0, sizeof(bstats));
+}
+
+void bcache_get_stats(struct bcache_stats *st) {
+	pthread_mutex_lock(&bcache_lock);
+	memcpy(st, &bstats, sizeof(struct bcache_stats));
+	pthread_mutex_unlock(&bcache_lock);
+}
+
+static int cmp_buf_blkno(const void *a, const void *b) {
+	int x = (*(struct buf* const*)a)->blkno;
+	int y = (*(struct buf* const*)b)->blkno;
+	return (x > y) - (x < y);
+}
+
+//Write every dirty buffer back to the disk, in block order
+int bio_flush() {
+	if (diskmap) {
+		msync(diskmap, diskmap_len, MS_ASYNC);
+	}
+	if (bcache_cap == 0) {
+		return 0;
+	}
+
+	struct buf **dirty = malloc(bcache_cap * sizeof(struct buf*));
+	if (!dirty) {
+		return -1;
+	}
+
+	// claim the dirty buffers, then write them out without holding the lock
+	pthread_mutex_lock(&bcache_lock);
+	size_t n = 0;
+	for (size_t i = 0; i < bcache_cap; i++) {
+		if (bufs[i].blkno >= 0 && bufs[i].dirty && !bufs[i].busy) {
+			bufs[i].busy = 1;
+			dirty[n++] = &bufs[i];
+		}
+	}
+	pthread_mutex_unlock(&bcache_lock);
+	qsort(dirty, n, sizeof(struct buf*), cmp_buf_blkno);
+	size_t nclaimed = n;
+
+	// one batch, with a request per run of consecutive blocks
+	struct iovec *iov = malloc(n * sizeof(struct iovec));
+	struct bio_req *reqs = malloc(n * sizeof(struct bio_req));
+	size_t *first = malloc(n * sizeof(size_t));
+	int ret = 0;
+	if (!iov || !reqs || !first) {
+		ret = -1;
+		for (size_t i = 0; i < n; i++)
+			dirty[i]->busy = -1;
+		n = 0;
+	}
+
+	size_t nreq = 0;
+	for (size_t i = 0; i < n; i++) {
+		iov[i] = (struct iovec){ dirty[i]->data, BLOCK_SIZE };
+		struct bio_req *r = nreq ? &reqs[nreq - 1] : NULL;
+		if (r && r->block_num + r->iovcnt == dirty[i]->blkno && r->iovcnt < BIO_MAX_IOV) {
+			r->iovcnt++;
+			continue;
+		}
+		first[nreq] = i;
+		reqs[nreq++] = (struct bio_req){ 1, dirty[i]->blkno, &iov[i], 1, 0 };
+	}
+	if (nreq > 0 && dev_submit(reqs, nreq) < 0)
+		ret = -1;
+
+	// busy = -1 remembers a failed write until the lock is taken again
+	for (size_t r = 0; r < nreq; r++) {
+		if (reqs[r].result == (ssize_t)reqs[r].iovcnt * BLOCK_SIZE)
+			continue;
+		for (int j = 0; j < reqs[r].iovcnt; j++)
+			dirty[first[r] + j]->busy = -1;
+	}
+	free(iov);
+	free(reqs);
+	free(first);
+
+	pthread_mutex_lock(&bcache_lock);
+	n = nclaimed;
+	for (size_t i = 0; i < n; i++) {
+		if (dirty[i]->busy > 0) {
+			dirty[i]->dirty = 0;
+			dirty[i]->failed = 0;
+		}
+		dirty[i]->busy = 0;
+	}
+	bstats.writebacks += n;
+	pthread_cond_broadcast(&bcache_cond);
+	pthread_mutex_unlock(&bcache_lock);
+
+	free(dirty);
+	return ret;
+}
+
+//Move a run of blocks: cached ones through the cache, the others in one batch
+//straight between the disk and the caller's buffers
+static int bio_rwv(int write, const int block_num, const struct iovec *iov, int iovcnt) {
+	size_t n = 0;
+	for (int i = 0; i < iovcnt; i++)
+		n += iov[i].iov_len / BLOCK_SIZE;
+	if (n == 0)
+		return 0;
+	if (write && jactive)
+		journal_revoke(block_num, n);
+
+	if (map_block(block_num) && map_block(block_num + n - 1)) {
+		for (size_t k = 0; k < n; k++) {
+			if (write)
+				memcpy(map_block(block_num + k), iov_block(iov, iovcnt, k), BLOCK_SIZE);
+			else
+				memcpy(iov_block(iov, iovcnt, k), map_block(block_num + k), BLOCK_SIZE);
+		}
+		return n * BLOCK_SIZE;
+	}
+
+	char *uncached = malloc(n);
+	if (!uncached)
+		return -1;
+	memset(uncached, 1, n);
+
+	if (bcache_cap > 0) {
+		pthread_mutex_lock(&bcache_lock);
+		for (size_t k = 0; k < n; ) {
+			struct buf *b = hash_lookup(block_num + k);
+			if (!b) {
+				bstats.direct++;
+				k++;
+				continue;
+			}
+			if (b->busy) {
+				buf_wait(b);
+				continue;
+			}
+
+			// cached blocks are read from and written to the cache, as bio_read/bio_write would
+			if (write) {
+				memcpy(b->data, iov_block(iov, iovcnt, k), BLOCK_SIZE);
+				b->dirty = 1;
+			} else {
+				memcpy(iov_block(iov, iovcnt, k), b->data, BLOCK_SIZE);
+			}
+			lru_unlink(b);
+			lru_push_front(b);
+			bstats.hits++;
+			uncached[k++] = 0;
+		}
+		pthread_mutex_unlock(&bcache_lock);
+	}
+
+	int ret = dev_rwv(write, block_num, iov, iovcnt, uncached, n);
+	free(uncached);
+	return ret < 0 ? -1 : (int)(n * BLOCK_SIZE);
+}
+
+//Read a block through the mapping or the cache
+static int cache_read(const int block_num, void *buf) {
+	char *m = map_block(block_num);
+	if (m) {
+		memcpy(buf, m, BLOCK_SIZE);
+		return BLOCK_SIZE;
+	}
+	if (bcache_cap == 0) {
+		return dev_read(block_num, buf);
+	}
+
+	int miss;
+	pthread_mutex_lock(&bcache_lock);
+	struct buf *b = bcache_get(block_num, &miss);
+	if (!b) {
+		pthread_mutex_unlock(&bcache_lock);
+		return dev_read(block_num, buf);
+	}
+	lru_unlink(b);
+	lru_push_front(b);
+
+	// a block that could not be read is not cached
+	if (miss) {
+		b->busy = 1;
+		pthread_mutex_unlock(&bcache_lock);
+		int ret = dev_read(block_num, b->data);
+		pthread_mutex_lock(&bcache_lock);
+		b->busy = 0;
+		pthread_cond_broadcast(&bcache_cond);
+		if (ret < 0) {
+			buf_discard(b);
+			pthread_mutex_unlock(&bcache_lock);
+			return -1;
+		}
+	}
+
+	memcpy(buf, b->data, BLOCK_SIZE);
+	pthread_mutex_unlock(&bcache_lock);
+	return BLOCK_SIZE;
+}
+
+//Write a block through the mapping or the cache
+static int cache_write(const int block_num, const void *buf) {
+	char *m = map_block(block_num);
+	if (m) {
+		memcpy(m, buf, BLOCK_SIZE);
+		return BLOCK_SIZE;
+	}
+	if (bcache_cap == 0) {
+		return dev_write(block_num, buf);
+	}
+
+	// whole-block writes never need the old contents, so a miss costs no read
+	int miss;
+	pthread_mutex_lock(&bcache_lock);
+	struct buf *b = bcache_get(block_num, &miss);
+	if (!b) {
+		pthread_mutex_unlock(&bcache_lock);
+		return dev_write(block_num, buf);
+	}
+	lru_unlink(b);
+	lru_push_front(b);
+
+	memcpy(b->data, buf, BLOCK_SIZE);
+	b->dirty = 1;
+	pthread_mutex_unlock(&bcache_lock);
+	return BLOCK_SIZE;
 }
 
 //Read a block from the disk
 int bio_read(const int block_num, void *buf) {
-    int retstat = 0;
-    retstat = pread(diskfile, buf, BLOCK_SIZE, block_num*BLOCK_SIZE);
-    if (retstat <= 0) {
-		memset (buf, 0, BLOCK_SIZE);
-		if (retstat < 0)
-			perror("block_read failed");
-    }
-
-    return retstat;
+	uint64_t start = stats_clock();
+	int ret = BLOCK_SIZE;
+	if (!jactive || !journal_lookup(block_num, buf)) {
+		ret = cache_read(block_num, buf);
+	}
+	stats_io_done(IO_READ, ret > 0 ? ret : 0, start);
+	return ret;
 }
 
-//Write a block to the disk
+//Write a block to the disk, or log it when the journal is on
 int bio_write(const int block_num, const void *buf) {
-    int retstat = 0;
-    retstat = pwrite(diskfile, buf, BLOCK_SIZE, block_num*BLOCK_SIZE);
-    if (retstat < 0) {
-		    perror("block_write failed");
-    }
-    return retstat;
+	uint64_t start = stats_clock();
+	int ret = jactive ? journal_write(block_num, buf) : cache_write(block_num, buf);
+	stats_io_done(IO_WRITE, ret > 0 ? ret : 0, start);
+	return ret;
+}
+
+//Read the contiguous run of blocks starting at block_num into the buffers of iov,
+//each of which holds a whole number of blocks
+int bio_readv(const int block_num, const struct iovec *iov, int iovcnt) {
+	uint64_t start = stats_clock();
+	int ret = bio_rwv(0, block_num, iov, iovcnt);
+	stats_io_done(IO_READV, ret > 0 ? ret : 0, start);
+	return ret;
+}
+
+//Write the buffers of iov, each holding a whole number of blocks, to the contiguous
+//run of blocks starting at block_num
+int bio_writev(const int block_num, const struct iovec *iov, int iovcnt) {
+	uint64_t start = stats_clock();
+	int ret = bio_rwv(1, block_num, iov, iovcnt);
+	stats_io_done(IO_WRITEV, ret > 0 ? ret : 0, start);
+	return ret;
+}
+
+//Punch the n blocks from block_num on out of the DISKFILE, so the host can reclaim their
+//storage; they read back as zeros. Cached copies are dropped without being written
+//and journaled images forgotten: the caller must own the blocks and hold nothing in them
+int bio_discard(const int block_num, size_t n) {
+	static int unsupported;		/* the host file system cannot punch holes */
+	uint64_t start = stats_clock();
+	if (diskfile < 0 || n == 0) {
+		return 0;
+	}
+	if (jactive)
+		journal_revoke(block_num, n);
+
+	// look the blocks up one by one, or look through the whole pool if that is smaller
+	if (bcache_cap > 0) {
+		pthread_mutex_lock(&bcache_lock);
+		for (size_t k = 0; k < n && k < bcache_cap; ) {
+			struct buf *b = (n > bcache_cap) ? &bufs[k] : hash_lookup(block_num + k);
+			if (b && b->busy) {
+				buf_wait(b);
+				continue;
+			}
+			if (b && b->blkno >= block_num && (size_t)(b->blkno - block_num) < n)
+				buf_discard(b);
+			k++;
+		}
+		pthread_mutex_unlock(&bcache_lock);
+	}
+
+	int ret = 0;
+	if (!__atomic_load_n(&unsupported, __ATOMIC_RELAXED) &&
+		fallocate(diskfile, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, (off_t)block_num * BLOCK_SIZE, (off_t)n * BLOCK_SIZE) < 0) {
+		if (errno == EOPNOTSUPP)
+			__atomic_store_n(&unsupported, 1, __ATOMIC_RELAXED);
+		ret = -1;
+	}
+	stats_io_done(IO_DISCARD, ret == 0 ? n * BLOCK_SIZE : 0, start);
+	return ret;
+}
+
+/*
+ * Metadata journal
+ *
+ * once journal_open() has attached a journal region, bio_write() no longer
+ * reaches the cache or the disk: the block goes into the running transaction,
+ * a table of block images in memory that bio_read() and bio_view() look at
+ * first. journal_freeze() closes the running transaction and starts a new
+ * one. journal_commit() then writes the frozen one to the journal in one
+ * sequential batch, a descriptor block with the home block numbers, the
+ * images and a commit record with a checksum over them all, waits for it to
+ * reach stable storage, and only then writes the blocks home (checkpoint).
+ * So the home copy of a metadata block never holds anything uncommitted, and
+ * a crash leaves at worst a complete transaction in the journal, which
+ * journal_open() replays. A transaction must fit in the journal, and the
+ * caller keeps it that way; after a failed commit the journal is left alone.
+ *
+ * The journal holds a single transaction, always written from its start: a
+ * transaction is checkpointed before the next one overwrites it, and
+ * replaying one twice does no harm. File data (bio_writev) is not journaled,
+ * but it is synced before a commit record that may point at it, and writing
+ * data to a block drops any image of it from the running transaction: the
+ * block was freed and reused, and the old image must not be written over it.
+ */
+#define JOURNAL_MAGIC			0x4c4e524a	/* "JRNL" */
+#define JOURNAL_COMMIT_MAGIC	0x54494d43	/* "CMIT" */
+#define JOURNAL_DESC_ENTRIES	((BLOCK_SIZE - 3 * sizeof(uint32_t)) / sizeof(uint32_t))
+#define JOURNAL_HASH			256
+#define JOURNAL_CSUM_INIT		0xcbf29ce484222325ULL
+
+struct journal_desc {
+	uint32_t	magic;
+	uint32_t	seq;			/* transaction number */
+	uint32_t	count;			/* images that follow this block */
+	uint32_t	blknos[JOURNAL_DESC_ENTRIES];	/* home block of each image */
+};
+
+struct journal_commit_rec {
+	uint32_t	magic;
+	uint32_t	seq;			/* same as the descriptor's */
+	uint32_t	count;
+	uint32_t	pad;
+	uint64_t	csum;			/* over the block numbers, then the images */
+};
+
+struct jblock {
+	int				blkno;
+	struct jblock*	next;			/* hash chain */
+	char			data[BLOCK_SIZE];
+};
+
+struct jtxn {
+	struct jblock*	tbl[JOURNAL_HASH];	/* chains, indexed by blkno & (JOURNAL_HASH - 1) */
+	size_t			count;
+};
+
+static int jdata;					/* file data written since the last commit */
+static int jfailed;					/* a commit failed, see journal_commit() */
+static uint32_t j_start;			/* first block of the journal */
+static uint32_t j_max;				/* most images one transaction can log */
+static uint32_t j_seq;				/* number of the next transaction */
+static struct jtxn jrun;			/* running transaction */
+static struct jtxn jfrozen;			/* transaction being committed */
+static struct journal_stats jstats;
+static pthread_mutex_t jlock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t jcond = PTHREAD_COND_INITIALIZER;
+
+//FNV-1a over 32-bit words; len is a multiple of 4
+static uint64_t journal_csum(uint64_t h, const void *p, size_t len) {
+	const uint32_t *w = p;
+	for (size_t i = 0; i < len / 4; i++) {
+		h ^= w[i];
+		h *= 0x100000001b3ULL;
+	}
+	return h;
+}
+
+static struct jblock *jtxn_find(struct jtxn *t, int block_num) {
+	struct jblock *j = t->tbl[block_num & (JOURNAL_HASH - 1)];
+	while (j && j->blkno != block_num)
+		j = j->next;
+	return j;
+}
+
+static void jtxn_remove(struct jtxn *t, int block_num) {
+	struct jblock **pp = &t->tbl[block_num & (JOURNAL_HASH - 1)];
+	while (*pp && (*pp)->blkno != block_num)
+		pp = &(*pp)->next;
+	if (*pp) {
+		struct jblock *j = *pp;
+		*pp = j->next;
+		free(j);
+		t->count--;
+	}
+}
+
+static void jtxn_clear(struct jtxn *t) {
+	for (size_t i = 0; i < JOURNAL_HASH; i++) {
+		while (t->tbl[i]) {
+			struct jblock *j = t->tbl[i];
+			t->tbl[i] = j->next;
+			free(j);
+		}
+	}
+	t->count = 0;
+}
+
+static int cmp_jblock_blkno(const void *a, const void *b) {
+	int x = (*(struct jblock* const*)a)->blkno;
+	int y = (*(struct jblock* const*)b)->blkno;
+	return (x > y) - (x < y);
+}
+
+//Copy the journaled image of block_num into buf; 0 if the block is not in a transaction
+static int journal_lookup(int block_num, void *buf) {
+	pthread_mutex_lock(&jlock);
+	struct jblock *j = jtxn_find(&jrun, block_num);
+	if (!j)
+		j = jtxn_find(&jfrozen, block_num);
+	if (j)
+		memcpy(buf, j->data, BLOCK_SIZE);
+	pthread_mutex_unlock(&jlock);
+	return j != NULL;
+}
+
+//Log a block in the running transaction; a later write of the same block replaces the image
+static int journal_write(int block_num, const void *buf) {
+	pthread_mutex_lock(&jlock);
+	struct jblock *j = jtxn_find(&jrun, block_num);
+	if (!j) {
+		j = malloc(sizeof(struct jblock));
+		if (!j) {
+			pthread_mutex_unlock(&jlock);
+			return -1;
+		}
+		j->blkno = block_num;
+		j->next = jrun.tbl[block_num & (JOURNAL_HASH - 1)];
+		jrun.tbl[block_num & (JOURNAL_HASH - 1)] = j;
+		jrun.count++;
+	}
+	memcpy(j->data, buf, BLOCK_SIZE);
+	pthread_mutex_unlock(&jlock);
+	return BLOCK_SIZE;
+}
+
+//A run of blocks is about to be written as file data: forget their images in the
+//running transaction and let a checkpoint in progress finish with them first
+static void journal_revoke(int block_num, size_t n) {
+	pthread_mutex_lock(&jlock);
+	jdata = 1;
+	for (size_t k = 0; k < n && (jrun.count > 0 || jfrozen.count > 0); k++) {
+		while (!jfailed && jtxn_find(&jfrozen, block_num + k))
+			pthread_cond_wait(&jcond, &jlock);
+		jtxn_remove(&jrun, block_num + k);
+	}
+	pthread_mutex_unlock(&jlock);
+}
+
+//Write a transaction found in the journal home if its commit record is intact
+static int journal_replay() {
+	struct journal_desc *desc = malloc(BLOCK_SIZE);
+	struct journal_commit_rec *rec = malloc(BLOCK_SIZE);
+	char *images = NULL;
+	int ret = -1;
+	if (!desc || !rec || dev_read(j_start, desc) < 0) {
+		goto out;
+	}
+	j_seq = desc->seq + 1;
+
+	ret = 0;
+	if (desc->magic != JOURNAL_MAGIC || desc->count == 0 || desc->count > j_max) {
+		goto out;
+	}
+
+	// the images and the commit record follow the descriptor
+	uint32_t n = desc->count;
+	images = malloc((size_t)n * BLOCK_SIZE);
+	if (!images) {
+		ret = -1;
+		goto out;
+	}
+	struct iovec iov[2] = { { images, (size_t)n * BLOCK_SIZE }, { rec, BLOCK_SIZE } };
+	struct bio_req req = { 0, j_start + 1, iov, 2, 0 };
+	if (dev_submit(&req, 1) < 0) {
+		ret = -1;
+		goto out;
+	}
+
+	// a transaction without its commit record, or with a torn one, never happened
+	uint64_t csum = journal_csum(JOURNAL_CSUM_INIT, desc->blknos, n * sizeof(uint32_t));
+	csum = journal_csum(csum, images, (size_t)n * BLOCK_SIZE);
+	if (rec->magic != JOURNAL_COMMIT_MAGIC || rec->seq != desc->seq || rec->count != n || rec->csum != csum) {
+		goto out;
+	}
+
+	for (uint32_t i = 0; i < n; i++)
+		cache_write(desc->blknos[i], images + (size_t)i * BLOCK_SIZE);
+	ret = (bio_flush() < 0 || dev_sync() < 0) ? -1 : (int)n;
+
+	// it is home now; a clean journal needs no replay next time
+	memset(desc, 0, BLOCK_SIZE);
+	if (dev_write(j_start, desc) < 0 || dev_sync() < 0)
+		ret = -1;
+
+out:
+	free(desc);
+	free(rec);
+	free(images);
+	return ret;
+}
+
+//Attach the journal of nblocks blocks at start_blk, replaying the transaction it holds.
+//Returns the number of blocks replayed, or -1
+int journal_open(uint32_t start_blk, uint32_t nblocks) {
+	if (jactive) {
+		return 0;
+	}
+	if (diskfile < 0 || nblocks < 3) {
+		return -1;
+	}
+
+	j_start = start_blk;
+	j_max = nblocks - 2;
+	if (j_max > JOURNAL_DESC_ENTRIES)
+		j_max = JOURNAL_DESC_ENTRIES;
+
+	// the journal is written around the cache, so nothing in it may be left to flush later
+	int n = bio_flush() < 0 ? -1 : journal_replay();
+	if (n < 0) {
+		perror("journal replay failed");
+		return -1;
+	}
+	memset(&jstats, 0, sizeof(jstats));
+	jstats.replayed = n;
+	jactive = 1;
+	return n;
+}
+
+//Commit whatever is still logged, mark the journal clean and detach it
+int journal_close() {
+	if (!jactive) {
+		return 0;
+	}
+	journal_freeze();
+	int ret = journal_commit();
+
+	// a journal that still holds what did not get home must be replayed
+	if (ret == 0) {
+		char *zero = calloc(1, BLOCK_SIZE);
+		if (!zero || dev_write(j_start, zero) < 0 || dev_sync() < 0)
+			ret = -1;
+		free(zero);
+	}
+
+	pthread_mutex_lock(&jlock);
+	jtxn_clear(&jrun);
+	jtxn_clear(&jfrozen);
+	jfailed = 0;
+	pthread_mutex_unlock(&jlock);
+	jactive = 0;
+	return ret;
+}
+
+int journal_active() {
+	return jactive;
+}
+
+//Most blocks one transaction may log, 0 without a journal
+size_t journal_capacity() {
+	return jactive ? j_max : 0;
+}
+
+//Number of blocks logged in the running transaction
+size_t journal_pending() {
+	pthread_mutex_lock(&jlock);
+	size_t n = jrun.count;
+	pthread_mutex_unlock(&jlock);
+	return n;
+}
+
+//Close the running transaction: what is logged from now on goes into the next one.
+//The previous transaction must have been committed
+void journal_freeze() {
+	pthread_mutex_lock(&jlock);
+	if (!jfailed) {
+		jfrozen = jrun;
+		memset(&jrun, 0, sizeof(jrun));
+	}
+	pthread_mutex_unlock(&jlock);
 }
 
+//Commit the frozen transaction and checkpoint it. Only one commit may run at a time.
+//Once one fails, nothing is written to the journal or home any more: the journal still
+//holds the last transaction that made it, for the next mount to replay, and the images
+//of this one stay where bio_read() finds them
+int journal_commit() {
+	// nobody but the committer changes the frozen transaction, so it is read without jlock
+	size_t n = jfrozen.count;
+	if (jfailed) {
+		return -1;
+	}
+	if (n == 0) {
+		return 0;
+	}
+
+	struct jblock **list = malloc(n * sizeof(struct jblock*));
+	struct journal_desc *desc = calloc(1, BLOCK_SIZE);
+	struct journal_commit_rec *rec = calloc(1, BLOCK_SIZE);
+	struct iovec *iov = malloc((j_max + 2) * sizeof(struct iovec));
+	struct bio_req *reqs = malloc(((j_max + 2) / BIO_MAX_IOV + 1) * sizeof(struct bio_req));
+	int ret = -1;
+	if (!list || !desc || !rec || !iov || !reqs) {
+		goto out;
+	}
+
+	// the transactions are kept small enough for it, one that is not cannot be made atomic
+	if (n > j_max) {
+		fprintf(stderr, "journal: transaction of %zu blocks does not fit in %u\n", n, j_max);
+		goto out;
+	}
+
+	size_t k = 0;
+	for (size_t i = 0; i < JOURNAL_HASH; i++) {
+		for (struct jblock *j = jfrozen.tbl[i]; j; j = j->next)
+			list[k++] = j;
+	}
+	qsort(list, n, sizeof(struct jblock*), cmp_jblock_blkno);
+
+	// the file data the transaction may point to has to be on stable storage first
+	pthread_mutex_lock(&jlock);
+	int data = jdata;
+	jdata = 0;
+	pthread_mutex_unlock(&jlock);
+	if (data && dev_sync() < 0) {
+		goto out;
+	}
+
+	desc->magic = JOURNAL_MAGIC;
+	desc->seq = j_seq;
+	desc->count = n;
+	iov[0] = (struct iovec){ desc, BLOCK_SIZE };
+	for (size_t b = 0; b < n; b++) {
+		desc->blknos[b] = list[b]->blkno;
+		iov[1 + b] = (struct iovec){ list[b]->data, BLOCK_SIZE };
+	}
+	uint64_t csum = journal_csum(JOURNAL_CSUM_INIT, desc->blknos, n * sizeof(uint32_t));
+	for (size_t b = 0; b < n; b++)
+		csum = journal_csum(csum, list[b]->data, BLOCK_SIZE);
+	*rec = (struct journal_commit_rec){ JOURNAL_COMMIT_MAGIC, j_seq, n, 0, csum };
+	iov[n + 1] = (struct iovec){ rec, BLOCK_SIZE };
+
+	// descriptor, images and commit record are laid out from the start of the journal
+	size_t nreq = 0;
+	for (size_t v = 0; v < n + 2; v += BIO_MAX_IOV) {
+		int c = (n + 2 - v < BIO_MAX_IOV) ? n + 2 - v : BIO_MAX_IOV;
+		reqs[nreq++] = (struct bio_req){ 1, j_start + v, &iov[v], c, 0 };
+	}
+	if (dev_submit(reqs, nreq) < 0 || dev_sync() < 0) {
+		goto out;
+	}
+	j_seq++;
+
+	// committed: the blocks can go home. Should that fail, the journal must keep
+	// them, so it is not written again
+	for (size_t b = 0; b < n; b++) {
+		if (cache_write(list[b]->blkno, list[b]->data) < 0)
+			goto out;
+	}
+	if (bio_flush() < 0 || dev_sync() < 0) {
+		goto out;
+	}
+	ret = 0;
+
+out:
+	free(list);
+	free(desc);
+	free(rec);
+	free(iov);
+	free(reqs);
+
+	pthread_mutex_lock(&jlock);
+	if (ret == 0) {
+		jstats.commits++;
+		jstats.blocks += n;
+		jtxn_clear(&jfrozen);
+	} else {
+		jfailed = 1;
+	}
+	pthread_cond_broadcast(&jcond);
+	pthread_mutex_unlock(&jlock);
+	if (ret < 0) {
+		fprintf(stderr, "journal: commit of %zu blocks failed, nothing more is committed\n", n);
+	}
+	return ret;
+}
+
+void journal_get_stats(struct journal_stats *st) {
+	pthread_mutex_lock(&jlock);
+	memcpy(st, &jstats, sizeof(struct journal_stats));
+	st->pending = jrun.count;
+	pthread_mutex_unlock(&jlock);
+}
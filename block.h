@@ -8,12 +8,61 @@
 #ifndef _BLOCK_H_
 #define _BLOCK_H_
 
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
 #define BLOCK_SIZE 4096
 
-void dev_init(const char* diskfile_path);
+/* default number of buffers in the block cache (4 MB) */
+#define BCACHE_DEFAULT_BLOCKS 1024
+
+struct bcache_stats {
+	uint64_t	hits;			/* lookups served from the cache */
+	uint64_t	misses;			/* lookups that had to claim a buffer */
+	uint64_t	evictions;		/* valid buffers recycled for another block */
+	uint64_t	writebacks;		/* dirty buffers written to the disk */
+	uint64_t	direct;			/* uncached blocks moved by bio_readv/bio_writev */
+	size_t		cached;			/* buffers currently holding a block */
+	size_t		capacity;		/* total number of buffers */
+};
+
+struct journal_stats {
+	uint64_t	commits;		/* transactions committed */
+	uint64_t	blocks;			/* blocks logged by them */
+	uint64_t	replayed;		/* blocks replayed when the journal was opened */
+	size_t		pending;		/* blocks in the running transaction */
+};
+
+void dev_init(const char* diskfile_path, size_t nblocks);
 int dev_open(const char* diskfile_path);
 void dev_close();
 int bio_read(const int block_num, void *buf);
 int bio_write(const int block_num, const void *buf);
+int bio_readv(const int block_num, const struct iovec *iov, int iovcnt);
+int bio_writev(const int block_num, const struct iovec *iov, int iovcnt);
+int bio_discard(const int block_num, size_t n);
+int bio_flush();
+int bio_sync();
+
+int dev_map(size_t nblocks);
+const void *bio_view(const int block_num, void *buf);
+void *bio_map(const int block_num);
+
+int bio_set_backend(const char *name);
+const char *bio_backend_name();
+
+int bcache_init(size_t nblocks);
+void bcache_destroy();
+void bcache_get_stats(struct bcache_stats *st);
+
+int journal_open(uint32_t start_blk, uint32_t nblocks);
+int journal_close();
+int journal_active();
+size_t journal_capacity();
+size_t journal_pending();
+void journal_freeze();
+int journal_commit();
+void journal_get_stats(struct journal_stats *st);
 
 #endif
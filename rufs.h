@@ -7,6 +7,8 @@
  */
 
 #include <linux/limits.h>
+#include <pthread.h>
+#include <stddef.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
@@ -14,31 +16,229 @@
 #define _TFS_H
 
 #define MAGIC_NUM 0x5C3A
-#define MAX_INUM 1024
-#define MAX_DNUM 16384
+
+/*
+ * volume geometry, chosen when rufs_mkfs makes the DISKFILE. Without any
+ * mkfs_* option the volume holds the inodes and data blocks of images from
+ * before they existed, in a single block group. Inode numbers are 16 bits
+ * wide everywhere, and UINT16_MAX means "none"
+ */
+#define DEFAULT_INODES		1024
+#define DEFAULT_DBLOCKS		16384
+#define MAX_INODES			UINT16_MAX
+#define MIN_DBLOCKS			64
+
+
+/*
+ * mount options
+ */
+struct rufs_options {
+	unsigned int	cache_blocks;		/* block cache size in blocks, 0 disables it */
+	char*			io_backend;			/* "pread" or "uring", NULL picks the best available */
+	int				use_mmap;			/* map the DISKFILE instead of caching its blocks */
+	int				lowlevel;			/* serve the kernel through the low-level API */
+	unsigned int	mkfs_size_mb;		/* volume size of a new DISKFILE, 0 for DEFAULT_DBLOCKS data blocks */
+	unsigned int	mkfs_inodes;		/* inodes of a new DISKFILE, 0 for DEFAULT_INODES */
+	unsigned int	mkfs_block_size;	/* block size of a new DISKFILE, 0 or BLOCK_SIZE */
+	int				zero_elide;			/* leave blocks written all zeros unallocated, as holes */
+	int				stats_on_exit;		/* print the STATS_FILE report to stderr on unmount */
+};
+
+#define RUFS_OPT(t, p) { t, offsetof(struct rufs_options, p), 1 }
+
+/* virtual file with the performance counters, see rufs.c */
+#define STATS_FILE			"/.rufs_stats"
+#define STATS_REPORT_MAX	16384
 
 
 struct superblock {
 	uint32_t	magic_num;			/* magic number */
-	uint16_t	max_inum;			/* maximum inode number */
-	uint16_t	max_dnum;			/* maximum data block number */
-	uint32_t	i_bitmap_blk;		/* start block of inode bitmap */
-	uint32_t	d_bitmap_blk;		/* start block of data block bitmap */
-	uint32_t	i_start_blk;		/* start block of inode region */
-	uint32_t	d_start_blk;		/* start block of data block region */
+	uint16_t	max_inum;			/* number of inodes */
+	uint16_t	max_dnum16;			/* number of data blocks, on images without block_size */
+	uint32_t	i_bitmap_blk;		/* start block of inode bitmap, group 0's with groups */
+	uint32_t	d_bitmap_blk;		/* start block of data block bitmap, group 0's with groups */
+	uint32_t	i_start_blk;		/* start block of inode region, group 0's with groups */
+	uint32_t	d_start_blk;		/* start block of data block region, group 0's with groups */
+	uint32_t	j_start_blk;		/* start block of the metadata journal */
+	uint32_t	j_blocks;			/* size of the journal, 0 on images without one */
+	uint32_t	block_size;			/* BLOCK_SIZE of the image, 0 on images from before it was recorded */
+	uint32_t	max_dnum;			/* number of data blocks, valid with block_size */
+	uint32_t	blocks;				/* size of the volume, valid with groups */
+	uint32_t	groups;				/* number of block groups, 0 on images with one flat layout */
+	uint32_t	g_start_blk;		/* first block of group 0 */
+	uint32_t	g_blocks;			/* blocks per group, fewer in the last one */
+	uint32_t	g_inodes;			/* inodes per group */
+	uint32_t	gd_blk;				/* start block of the group descriptors, 0 on images without them */
+	uint32_t	state;				/* SB_MOUNTED until a clean unmount, 0 on images from before it */
+};
+
+#define SB_MOUNTED		0x1			/* not cleanly unmounted: unlinked inodes may be left */
+
+/*
+ * group descriptor, one per block group in the blocks from gd_blk on. The
+ * free counts let a mount skip reading the bitmaps until a group is used
+ */
+struct group_desc {
+	uint32_t	free_blocks;		/* free data blocks in the group */
+	uint32_t	free_inodes;		/* free inodes in the group */
 };
 
+#define GD_PER_BLOCK	((int)(BLOCK_SIZE / sizeof(struct group_desc)))
+
+/*
+ * metadata journal, see block.c: committed every JOURNAL_COMMIT_SECS, or
+ * sooner once the running transaction holds JOURNAL_COMMIT_BLOCKS blocks
+ */
+#define JOURNAL_BLOCKS			1024
+#define JOURNAL_COMMIT_SECS		5
+#define JOURNAL_COMMIT_BLOCKS	256
+
+/*
+ * journal blocks an operation may add to the running transaction, which
+ * txn_begin() keeps room for: TXN_OP_BLOCKS for the inodes and directory
+ * blocks it changes, TXN_RUN_BLOCKS per run of blocks it allocates (bitmaps,
+ * descriptor, extent tree nodes split up to a new root) and TXN_FREE_BLOCKS
+ * for a step freeing up to TXN_FREE_RUNS runs. A flush allocates at most
+ * TXN_FLUSH_RUNS runs per step, and turning a full linear directory into a
+ * hashed one takes up to TXN_DIR_HASH_BLOCKS
+ */
+#define TXN_OP_BLOCKS			64
+#define TXN_RUN_BLOCKS			(3 + 6 * (EXT_MAX_DEPTH + 1))
+#define TXN_FLUSH_RUNS			8
+#define TXN_FREE_RUNS			BLKRUN_BATCH
+#define TXN_FREE_BLOCKS			(3 * TXN_FREE_RUNS + EXT_MAX_DEPTH + 2)
+#define TXN_DIR_HASH_BLOCKS		256
+
 struct inode {
 	uint16_t	ino;				/* inode number */
-	uint16_t	valid;				/* validity of the inode */
+	uint8_t		valid;				/* validity of the inode */
+	uint8_t		flags;				/* INODE_FL_* */
 	uint32_t	size;				/* size of the file */
 	uint32_t	type;				/* type of the file */
 	uint32_t	link;				/* link count */
-	int			direct_ptr[16];		/* direct pointer to data block */
-	int			indirect_ptr[8];	/* indirect pointer to data block */
+	union {
+		struct {
+			int		direct_ptr[16];		/* direct pointer to data block */
+			int		indirect_ptr[8];	/* indirect pointer to data block */
+		};
+		uint32_t	extent_root[24];	/* extent tree root, with INODE_FL_EXTENTS */
+		char		inline_data[96];	/* the file's contents, with INODE_FL_INLINE */
+	};
 	struct stat	vstat;				/* inode stat */
 };
 
+#define INODE_FL_HASHED		0x01		/* directory uses the hashed layout */
+#define INODE_FL_EXTENTS	0x02		/* file blocks are mapped by an extent tree */
+#define INODE_FL_DIRRECS	0x04		/* directory entries are struct dir_rec records */
+#define INODE_FL_INLINE		0x08		/* file data is stored in the inode itself */
+#define INODE_FL_UNLINKED	0x10		/* the last link is gone, freed with the last pin */
+
+#define INODE_INLINE_MAX	((int)sizeof(((struct inode*)0)->inline_data))
+
+/*
+ * extent tree
+ *
+ * every node is a header followed by entries sorted by lblk. The root lives
+ * in the inode's extent_root, the other nodes fill a block each. In a leaf
+ * (depth 0) an entry maps len file blocks from lblk onto the disk blocks
+ * from pblk; in an index node it points at the child block pblk holding
+ * the entries from lblk on.
+ */
+#define EXT_MAGIC		0xf30e
+#define EXT_MAX_DEPTH	4
+
+struct extent_header {
+	uint16_t	magic;				/* EXT_MAGIC */
+	uint16_t	count;				/* number of valid entries */
+	uint16_t	max;				/* capacity of the node */
+	uint16_t	depth;				/* 0 for a leaf */
+};
+
+struct extent {
+	uint32_t	lblk;				/* first file block covered */
+	uint32_t	len;				/* number of blocks, unused in index nodes */
+	uint32_t	pblk;				/* first disk block, or child node block */
+};
+
+#define EXT_ROOT_ENTRIES	((int)((24 * sizeof(uint32_t) - sizeof(struct extent_header)) / sizeof(struct extent)))
+#define EXT_BLOCK_ENTRIES	((int)((BLOCK_SIZE - sizeof(struct extent_header)) / sizeof(struct extent)))
+
+/*
+ * in-core inode, cached by ino
+ */
+#define ICACHE_BUCKETS	256
+#define ICACHE_MAX_IDLE	512				/* unpinned inodes kept cached */
+
+struct icache_entry {
+	struct inode			inode;		/* cached copy of the on-disk inode, must come first */
+	uint32_t				refcnt;		/* pins held by open files and lock holders */
+	int						dirty;		/* cached copy is newer than the inode table */
+	int						loading;	/* being read in from the inode table, not usable yet */
+	pthread_rwlock_t		lock;		/* file data and size, see ilock() */
+	pthread_rwlock_t		dir_lock;	/* directory entries, see dlock() */
+	struct icache_entry*	hash_next;	/* next entry in the same hash bucket */
+	struct icache_entry*	idle_prev;	/* idle list links, only used while unpinned */
+	struct icache_entry*	idle_next;
+	struct wbuf*			wbuf;		/* buffered writes, guarded by lock */
+	struct file_handle*		handles;	/* open handles reading ahead, guarded by icache_lock */
+};
+
+/*
+ * write buffer of a file: blocks written but not yet on disk, most of them
+ * not even allocated yet (delayed allocation)
+ */
+#define WBUF_FILE_BLOCKS	256			/* a file's buffer is flushed once it holds this many */
+#define WBUF_MAX_BLOCKS		4096		/* or once all buffers together hold this many */
+
+struct wbuf_blk {
+	uint32_t	lblk;				/* file block */
+	int			reserved;			/* not allocated yet, a block is reserved for it */
+	char		data[BLOCK_SIZE];
+};
+
+struct wbuf {
+	uint32_t			count;		/* number of buffered blocks */
+	uint32_t			cap;		/* size of blks */
+	struct wbuf_blk**	blks;		/* sorted by lblk */
+};
+
+/*
+ * readahead state of an open file: the window of blocks being read and the
+ * one after it, which is fetched in the background. A window starts at
+ * RA_MIN_BLOCKS and doubles up to RA_MAX_BLOCKS while reads stay sequential
+ */
+#define RA_MIN_BLOCKS	8
+#define RA_MAX_BLOCKS	128
+
+struct ra_window {
+	uint32_t	start;				/* first file block */
+	uint32_t	count;				/* number of blocks, 0 if empty */
+	char*		data;				/* room for RA_MAX_BLOCKS blocks */
+};
+
+struct readahead {
+	pthread_mutex_t		lock;		/* guards everything below */
+	pthread_cond_t		cond;		/* a fill has ended */
+	uint32_t			next_lblk;	/* where a sequential read goes on */
+	uint32_t			size;		/* window size, 0 while reads are random */
+	int					filling;	/* ahead is being read and cannot be used yet */
+	int					stale;		/* the file changed while it was */
+	struct ra_window	cur;		/* window being read */
+	struct ra_window	ahead;		/* window after it */
+	uint32_t			pblk[RA_MAX_BLOCKS];	/* disk blocks of ahead, 0 for holes */
+	struct readahead*	queue_next;	/* next in the readahead thread's queue */
+};
+
+/*
+ * open file: what fi->fh points to from open or create until release
+ */
+struct file_handle {
+	uint16_t				ino;		/* the file's inode number */
+	struct icache_entry*	e;			/* its inode, pinned in the inode cache */
+	struct readahead*		ra;			/* this reader's readahead windows, NULL if it has none */
+	struct file_handle*		next;		/* next handle of the same inode on e->handles */
+};
+
 struct dirent {
 	uint16_t ino;					/* inode number of the directory entry */
 	uint16_t valid;					/* validity of the directory entry */
@@ -46,6 +246,130 @@ struct dirent {
 	uint16_t len;					/* length of name */
 };
 
+/*
+ * on-disk directory entry of an INODE_FL_DIRRECS directory. Records are
+ * packed into each block (or bucket) and chained by rec_len up to its end;
+ * the space past a record's name and any record with name_len 0 are free.
+ * Older images use fixed-size struct dirent slots, read as they are and
+ * rewritten as records when the directory is next changed.
+ */
+struct dir_rec {
+	uint16_t	ino;				/* inode number of the entry */
+	uint16_t	rec_len;			/* bytes to the next record, a multiple of 4 */
+	uint8_t		name_len;			/* length of name, 0 if the record is free */
+	char		name[];				/* not NUL-terminated */
+};
+
+#define DIR_REC_LEN(n)		((uint32_t)((offsetof(struct dir_rec, name) + (n) + 3) & ~3))
+
+/*
+ * hashed directory layout
+ *
+ * the first block of a hashed directory is its index: 1 << depth slots,
+ * each holding the block number of the bucket for the names whose
+ * dir_hash() has those low bits. Buckets are chained through next once the
+ * index has reached DIR_INDEX_MAX_DEPTH.
+ */
+#define DIR_INDEX_MAGIC		0x58444852	/* "RHDX", never a valid linear dirent */
+#define DIR_BUCKET_MAGIC	0x4b434252	/* "RBCK" */
+#define DIR_INDEX_MAX_DEPTH	9
+
+struct dir_index {
+	uint32_t	magic;				/* DIR_INDEX_MAGIC */
+	uint32_t	depth;				/* global depth: the index has 1 << depth slots */
+	uint32_t	slots[];			/* bucket block numbers */
+};
+
+struct dir_bucket {
+	uint32_t	magic;				/* DIR_BUCKET_MAGIC */
+	uint16_t	depth;				/* local depth: hash bits shared by all entries */
+	uint16_t	count;				/* number of valid entries */
+	uint32_t	next;				/* overflow bucket block, 0 if none */
+	char		entries[];			/* dir_rec records, or struct dirent slots on older images */
+};
+
+#define DIR_BUCKET_AREA		((uint32_t)(BLOCK_SIZE - sizeof(struct dir_bucket)))
+
+
+/*
+ * dentry cache entry: name in directory parent resolves to ino
+ */
+#define DCACHE_BUCKETS		1024
+#define DCACHE_MAX_ENTRIES	4096
+#define DCACHE_NEGATIVE		(-1)		/* ino of a cached failed lookup */
+
+struct dcache_entry {
+	uint16_t				parent;		/* inode number of the directory */
+	int32_t					ino;		/* inode number of the entry, or DCACHE_NEGATIVE */
+	uint16_t				len;		/* length of name */
+	struct dcache_entry*	hash_next;	/* next entry in the same hash bucket */
+	struct dcache_entry*	lru_prev;
+	struct dcache_entry*	lru_next;
+	char					name[];		/* not NUL-terminated */
+};
+
+
+/*
+ * bitmap allocator state, one per bitmap
+ */
+#define BALLOC_REGION_BITS	512			/* bits per free-count region, a multiple of 64 */
+
+struct balloc {
+	unsigned char*	map;			/* the in-memory bitmap, padded to whole blocks */
+	uint32_t		nbits;			/* number of bits in use */
+	uint32_t		blk;			/* first disk block of the bitmap */
+	uint32_t		nblks;			/* number of disk blocks it spans */
+	uint32_t		cursor;			/* where searches without a goal start */
+	uint32_t		nfree;			/* free bits in total, not counting pend */
+	uint32_t		nregions;
+	uint32_t*		region_free;	/* free bits per BALLOC_REGION_BITS region, not counting pend */
+	uint64_t*		region_avail;	/* bit r set while region r has free bits */
+	unsigned char*	blk_dirty;		/* bit k set while block k of map is newer than the disk */
+	unsigned char*	pend;			/* freed bits kept from reuse until the commit that frees them */
+	int				dirty;			/* some block of map is dirty */
+};
+
+/*
+ * runs of data blocks being freed. A batch collects the runs an operation
+ * frees, to return them to the bitmaps under a single alloc_lock; a list
+ * holds the freed runs waiting to be punched out of the DISKFILE
+ */
+#define BLKRUN_BATCH	64
+
+struct blkrun {
+	uint32_t	blk;				/* first disk block */
+	uint32_t	len;				/* number of blocks */
+};
+
+struct blkrun_batch {
+	uint32_t		count;
+	struct blkrun	runs[BLKRUN_BATCH];
+};
+
+struct blkrun_list {
+	uint32_t		count;
+	uint32_t		cap;			/* size of runs */
+	struct blkrun*	runs;
+};
+
+/*
+ * block group: a data block bitmap, an inode bitmap, a slice of the inode
+ * table and the data blocks, in that order. Group g holds the inodes from
+ * g * g_inodes on
+ */
+struct group {
+	uint32_t		d_bitmap_blk;	/* start block of the data block bitmap */
+	uint32_t		i_bitmap_blk;	/* start block of the inode bitmap */
+	uint32_t		i_start_blk;	/* start block of the inode table slice */
+	uint32_t		d_start_blk;	/* first data block */
+	uint32_t		ndata;			/* number of data blocks */
+	uint32_t		first_ino;		/* inode number of the first inode */
+	uint32_t		ninodes;		/* number of inodes */
+	int				loaded;			/* the bitmaps below have been read */
+	struct balloc	ialloc;			/* allocator state of the inode bitmap */
+	struct balloc	dalloc;			/* allocator state of the data block bitmap */
+};
+
 
 /*
  * bitmap operations
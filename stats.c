@@ -0,0 +1,230 @@
+/*
+ *  Copyright (C) 2023 CS416 Rutgers CS
+ *	Tiny File System
+ *	File:	stats.c
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "stats.h"
+
+/*
+ * Performance counters
+ *
+ * every thread counts into a struct stats of its own, so the hot path takes
+ * no lock and shares no cache line with other threads: the owner is the only
+ * writer of its counters and just stores the new value (relaxed), which
+ * stats_get() may load at any time. The blocks of all live threads are kept
+ * on a list; when a thread exits, its counts are folded into retired and
+ * its block freed. stats_reset() does not touch the counters either: it
+ * records the current totals as the baseline the next stats_get() subtracts.
+ */
+struct stats_block {
+	struct stats			st;
+	struct stats_block*		next;
+};
+
+static __thread struct stats_block *local;
+static struct stats_block *blocks;			// every live thread's counters
+static struct stats retired;				// counts of threads that have exited
+static struct stats base;					// totals at the last reset
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t stats_key;
+static pthread_once_t stats_once = PTHREAD_ONCE_INIT;
+
+static const char *op_names[OP_COUNT] = {
+	"getattr", "readdir", "opendir", "mkdir", "create", "open", "read", "write",
+	"rmdir", "releasedir", "unlink", "truncate", "flush", "fsync", "utimens", "release",
+	"lookup", "forget", "setattr"
+};
+
+static const char *io_names[IO_COUNT] = {
+	"bio_read", "bio_write", "bio_readv", "bio_writev", "bio_discard"
+};
+
+static const char *alloc_names[ALLOC_COUNT] = {
+	"inodes", "inodes_freed", "blocks", "block_runs", "blocks_freed", "blocks_reserved", "failed",
+	"zero_elided"
+};
+
+#define STATS_WORDS (sizeof(struct stats) / sizeof(uint64_t))
+
+//Add every counter of src to dst, reading src as another thread may be storing to it
+static void stats_add(struct stats *dst, struct stats *src) {
+	uint64_t *d = (uint64_t *)dst, *s = (uint64_t *)src;
+	for (size_t i = 0; i < STATS_WORDS; i++)
+		d[i] += __atomic_load_n(&s[i], __ATOMIC_RELAXED);
+}
+
+//Fold the counts of an exiting thread into retired
+static void stats_thread_exit(void *arg) {
+	struct stats_block *b = arg;
+	pthread_mutex_lock(&stats_lock);
+	struct stats_block **pp = &blocks;
+	while (*pp != b)
+		pp = &(*pp)->next;
+	*pp = b->next;
+	stats_add(&retired, &b->st);
+	pthread_mutex_unlock(&stats_lock);
+	free(b);
+}
+
+static void stats_key_init(void) {
+	pthread_key_create(&stats_key, stats_thread_exit);
+}
+
+//This thread's counters, NULL if they cannot be allocated
+static inline struct stats *stats_local() {
+	if (local)
+		return &local->st;
+
+	pthread_once(&stats_once, stats_key_init);
+	struct stats_block *b = calloc(1, sizeof(struct stats_block));
+	if (!b)
+		return NULL;
+	pthread_mutex_lock(&stats_lock);
+	b->next = blocks;
+	blocks = b;
+	pthread_mutex_unlock(&stats_lock);
+	pthread_setspecific(stats_key, b);
+	local = b;
+	return &b->st;
+}
+
+static inline void stat_inc(uint64_t *c, uint64_t v) {
+	__atomic_store_n(c, *c + v, __ATOMIC_RELAXED);
+}
+
+//Monotonic time in nanoseconds, for the start of a timed operation
+uint64_t stats_clock() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+//Count an operation that started at start and returned ret
+void stats_op_done(enum stats_op op, uint64_t start, int ret) {
+	struct stats *st = stats_local();
+	if (!st)
+		return;
+
+	uint64_t ns = stats_clock() - start;
+	uint64_t us = ns / 1000;
+	int bucket = us ? 64 - __builtin_clzll(us) : 0;
+	if (bucket >= STATS_HIST_BUCKETS)
+		bucket = STATS_HIST_BUCKETS - 1;
+
+	struct stats_op_counters *c = &st->op[op];
+	stat_inc(&c->calls, 1);
+	stat_inc(&c->ns, ns);
+	stat_inc(&c->hist[bucket], 1);
+	if (ret < 0)
+		stat_inc(&c->errors, 1);
+}
+
+//Count a block layer call that moved bytes and started at start
+void stats_io_done(enum stats_io io, size_t bytes, uint64_t start) {
+	struct stats *st = stats_local();
+	if (!st)
+		return;
+
+	struct stats_io_counters *c = &st->io[io];
+	stat_inc(&c->calls, 1);
+	stat_inc(&c->bytes, bytes);
+	stat_inc(&c->ns, stats_clock() - start);
+}
+
+void stats_alloc(enum stats_alloc what, uint64_t n) {
+	struct stats *st = stats_local();
+	if (st)
+		stat_inc(&st->alloc[what], n);
+}
+
+static void stats_total(struct stats *st) {
+	memcpy(st, &retired, sizeof(struct stats));
+	for (struct stats_block *b = blocks; b; b = b->next)
+		stats_add(st, &b->st);
+}
+
+//Sum the counters of all threads since the last reset
+void stats_get(struct stats *st) {
+	pthread_mutex_lock(&stats_lock);
+	stats_total(st);
+	uint64_t *d = (uint64_t *)st, *s = (uint64_t *)&base;
+	for (size_t i = 0; i < STATS_WORDS; i++)
+		d[i] -= s[i];
+	pthread_mutex_unlock(&stats_lock);
+}
+
+void stats_reset() {
+	pthread_mutex_lock(&stats_lock);
+	stats_total(&base);
+	pthread_mutex_unlock(&stats_lock);
+}
+
+//Upper bound, in us, of the histogram bucket holding the given fraction of the calls
+static uint64_t hist_percentile(const struct stats_op_counters *c, double frac) {
+	uint64_t want = (uint64_t)(c->calls * frac), seen = 0;
+	for (int b = 0; b < STATS_HIST_BUCKETS; b++) {
+		seen += c->hist[b];
+		if (seen > want)
+			return 1ull << b;
+	}
+	return 1ull << (STATS_HIST_BUCKETS - 1);
+}
+
+#define APPEND(...) do { \
+	int n = snprintf(buf + len, len < size ? size - len : 0, __VA_ARGS__); \
+	if (n > 0) \
+		len += n; \
+} while (0)
+
+//Write a text report of the counters since the last reset into buf; returns
+//its full length, which may exceed size as with snprintf
+size_t stats_format(char *buf, size_t size) {
+	struct stats st;
+	size_t len = 0;
+	stats_get(&st);
+
+	APPEND("%-12s %12s %8s %10s %10s %10s\n", "op", "calls", "errors", "avg_us", "p50_us", "p99_us");
+	for (int i = 0; i < OP_COUNT; i++) {
+		struct stats_op_counters *c = &st.op[i];
+		if (c->calls == 0)
+			continue;
+		APPEND("%-12s %12llu %8llu %10.1f %10llu %10llu\n", op_names[i],
+			(unsigned long long)c->calls, (unsigned long long)c->errors, c->ns / 1000.0 / c->calls,
+			(unsigned long long)hist_percentile(c, 0.5), (unsigned long long)hist_percentile(c, 0.99));
+	}
+
+	// histograms list the non-empty buckets by their upper bound in us
+	APPEND("\nlatency histograms (calls under N us)\n");
+	for (int i = 0; i < OP_COUNT; i++) {
+		struct stats_op_counters *c = &st.op[i];
+		if (c->calls == 0)
+			continue;
+		APPEND("%-12s", op_names[i]);
+		for (int b = 0; b < STATS_HIST_BUCKETS; b++) {
+			if (c->hist[b])
+				APPEND(" %llu:%llu", 1ull << b, (unsigned long long)c->hist[b]);
+		}
+		APPEND("\n");
+	}
+
+	APPEND("\n%-12s %12s %14s %10s\n", "block io", "calls", "bytes", "avg_us");
+	for (int i = 0; i < IO_COUNT; i++) {
+		struct stats_io_counters *c = &st.io[i];
+		APPEND("%-12s %12llu %14llu %10.1f\n", io_names[i], (unsigned long long)c->calls,
+			(unsigned long long)c->bytes, c->calls ? c->ns / 1000.0 / c->calls : 0.0);
+	}
+
+	APPEND("\nallocator");
+	for (int i = 0; i < ALLOC_COUNT; i++)
+		APPEND(" %s=%llu", alloc_names[i], (unsigned long long)st.alloc[i]);
+	APPEND("\n");
+	return len;
+}
@@ -0,0 +1,92 @@
+/*
+ *  Copyright (C) 2023 CS416 Rutgers CS
+ *	Tiny File System
+ *	File:	stats.h
+ *
+ */
+
+#ifndef _STATS_H_
+#define _STATS_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* file system operations, one per handler in rufs_ope and rufs_ll_ope */
+enum stats_op {
+	OP_GETATTR,
+	OP_READDIR,
+	OP_OPENDIR,
+	OP_MKDIR,
+	OP_CREATE,
+	OP_OPEN,
+	OP_READ,
+	OP_WRITE,
+	OP_RMDIR,
+	OP_RELEASEDIR,
+	OP_UNLINK,
+	OP_TRUNCATE,
+	OP_FLUSH,
+	OP_FSYNC,
+	OP_UTIMENS,
+	OP_RELEASE,
+	OP_LOOKUP,		/* the low-level interface only */
+	OP_FORGET,
+	OP_SETATTR,
+	OP_COUNT
+};
+
+/* block layer entry points */
+enum stats_io {
+	IO_READ,		/* bio_read */
+	IO_WRITE,		/* bio_write */
+	IO_READV,		/* bio_readv */
+	IO_WRITEV,		/* bio_writev */
+	IO_DISCARD,		/* bio_discard */
+	IO_COUNT
+};
+
+/* allocator events */
+enum stats_alloc {
+	ALLOC_INODES,			/* inodes allocated */
+	ALLOC_INODES_FREED,		/* inodes freed */
+	ALLOC_BLOCKS,			/* data blocks allocated, singly or in runs */
+	ALLOC_RUNS,				/* requests for a run of blocks */
+	ALLOC_BLOCKS_FREED,		/* data blocks freed */
+	ALLOC_RESERVED,			/* data blocks reserved for delayed allocation */
+	ALLOC_FAILED,			/* allocations and reservations that found no space */
+	ALLOC_ZERO_ELIDED,		/* blocks of zeros left unallocated (zero_elide) */
+	ALLOC_COUNT
+};
+
+/* latency histogram: bucket 0 is under 1 us, bucket b from 2^(b-1) us up to 2^b us */
+#define STATS_HIST_BUCKETS	28
+
+struct stats_op_counters {
+	uint64_t	calls;
+	uint64_t	errors;			/* calls that returned a negative errno */
+	uint64_t	ns;				/* total time spent in them */
+	uint64_t	hist[STATS_HIST_BUCKETS];
+};
+
+struct stats_io_counters {
+	uint64_t	calls;
+	uint64_t	bytes;
+	uint64_t	ns;
+};
+
+struct stats {
+	struct stats_op_counters	op[OP_COUNT];
+	struct stats_io_counters	io[IO_COUNT];
+	uint64_t					alloc[ALLOC_COUNT];
+};
+
+uint64_t stats_clock();
+void stats_op_done(enum stats_op op, uint64_t start, int ret);
+void stats_io_done(enum stats_io io, size_t bytes, uint64_t start);
+void stats_alloc(enum stats_alloc what, uint64_t n);
+
+void stats_get(struct stats *st);
+void stats_reset();
+size_t stats_format(char *buf, size_t size);
+
+#endif